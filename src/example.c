@@ -1,7 +1,555 @@
 #include "tensor.h"
 #include "nn.h"
 
+// Deterministic pseudo-random values in [-1, 1) so these checks do not need data files
+static void fill_tensor(Tensor *t, size_t seed) {
+    size_t num_elements = get_tensor_element_count(t);
+
+    // Hash the index instead of stepping through a short cycle, so rows of
+    // large tensors do not repeat and logits do not tie
+    for (size_t i = 0; i < num_elements; i++) {
+        size_t hash = (i + 1) * 2654435761u + seed * 40503u;
+
+        hash ^= hash >> 13;
+        hash *= 0x5bd1e995u;
+        hash ^= hash >> 15;
+
+        t->data[i] = (float) (hash % 2000) / 1000.0f - 1.0f;
+    }
+}
+
+static float max_abs_difference(const Tensor *a, const Tensor *b) {
+    assert(get_tensor_element_count(a) == get_tensor_element_count(b));
+
+    Tensor *a_copy = copy_tensor(a);
+    Tensor *b_copy = copy_tensor(b);
+
+    size_t num_elements = get_tensor_element_count(a);
+    float max_difference = 0;
+
+    for (size_t i = 0; i < num_elements; i++) {
+        float difference = fabsf(a_copy->data[i] - b_copy->data[i]);
+
+        max_difference = max_difference > difference ? max_difference : difference;
+    }
+
+    destroy_tensor(a_copy);
+    destroy_tensor(b_copy);
+
+    return max_difference;
+}
+
+static int compare_floats_descending(const void *a, const void *b) {
+    float x = *(const float *) a;
+    float y = *(const float *) b;
+
+    return (x < y) - (x > y);
+}
+
+static void check_linear_softmax_top_k(void) {
+    // More classes than CLASSIFIER_TILE_SIZE, so the running sum is rescaled across tiles
+    size_t batch_size = 3, input_size = 40, output_size = 1000;
+
+    Tensor *input = create_tensor(2, (size_t[]) {batch_size, input_size});
+    Tensor *weight = create_tensor(2, (size_t[]) {output_size, input_size});
+    Tensor *bias = create_tensor(1, (size_t[]) {output_size});
+
+    fill_tensor(input, 1);
+    fill_tensor(weight, 2);
+    fill_tensor(bias, 3);
+
+    // Scale the logits up so the probabilities are far from uniform
+    for (size_t i = 0; i < output_size * input_size; i++) {
+        weight->data[i] *= 2.0f;
+    }
+
+    Tensor *logits = linear(input, weight, bias);
+    Tensor *probabilities = softmax(logits);
+
+    float *sorted_probabilities = malloc(output_size * sizeof *sorted_probabilities);
+    size_t *top_indices = malloc(batch_size * output_size * sizeof *top_indices);
+    float *top_probabilities = malloc(batch_size * output_size * sizeof *top_probabilities);
+    assert(sorted_probabilities != NULL);
+    assert(top_indices != NULL);
+    assert(top_probabilities != NULL);
+
+    size_t ks[] = {1, 7, output_size};
+    float max_difference = 0;
+
+    for (size_t i = 0; i < sizeof ks / sizeof *ks; i++) {
+        size_t k = ks[i];
+
+        linear_softmax_top_k(input, weight, bias, k, top_indices, top_probabilities);
+
+        for (size_t b = 0; b < batch_size; b++) {
+            const float *row = &probabilities->data[b * output_size];
+
+            for (size_t j = 0; j < output_size; j++) {
+                sorted_probabilities[j] = row[j];
+            }
+
+            qsort(sorted_probabilities, output_size, sizeof *sorted_probabilities, compare_floats_descending);
+
+            // Compare by rank, so classes with tied probabilities may come in either order
+            for (size_t r = 0; r < k; r++) {
+                size_t index = top_indices[b * k + r];
+
+                assert(index < output_size);
+
+                float rank_difference = fabsf(top_probabilities[b * k + r] - sorted_probabilities[r]);
+                float index_difference = fabsf(row[index] - sorted_probabilities[r]);
+
+                max_difference = max_difference > rank_difference ? max_difference : rank_difference;
+                max_difference = max_difference > index_difference ? max_difference : index_difference;
+
+                for (size_t q = 0; q < r; q++) {
+                    assert(top_indices[b * k + q] != index);
+                }
+            }
+        }
+    }
+
+    printf("TOP-K MAX DIFF: %g\n", (double) max_difference);
+    assert(max_difference < 1e-5f);
+
+    free(top_probabilities);
+    free(top_indices);
+    free(sorted_probabilities);
+    destroy_tensor(probabilities);
+    destroy_tensor(logits);
+    destroy_tensor(bias);
+    destroy_tensor(weight);
+    destroy_tensor(input);
+}
+
+static void check_tensor_views(void) {
+    Tensor *input = create_tensor(4, (size_t[]) {4, 3, 6, 6});
+    Tensor *weight = create_tensor(4, (size_t[]) {5, 3, 3, 3});
+    Tensor *bias = create_tensor(1, (size_t[]) {5});
+
+    fill_tensor(input, 1);
+    fill_tensor(weight, 2);
+    fill_tensor(bias, 3);
+
+    // Split a batch into per-request views, run each one and concat the results
+
+    Tensor *full_output = conv_relu_max_pool_2d(input, weight, bias, 1, 2, 2);
+
+    Tensor *requests[2];
+    split_tensor_batch(input, 2, (size_t[]) {1, 3}, requests);
+
+    Tensor *request_outputs[2];
+
+    for (size_t i = 0; i < 2; i++) {
+        assert(is_tensor_contiguous(requests[i]));
+
+        request_outputs[i] = conv_relu_max_pool_2d(requests[i], weight, bias, 1, 2, 2);
+    }
+
+    Tensor *batched_output = create_tensor(full_output->n_dims, full_output->dims);
+    concat_tensors_into(batched_output, 0, 2, (const Tensor *const[]) {request_outputs[0], request_outputs[1]});
+
+    printf("SPLIT/CONCAT DIFF: %f\n", (double) max_abs_difference(batched_output, full_output));
+    assert(max_abs_difference(batched_output, full_output) == 0);
+
+    // Concat along the last dimension, from a slice of a slice
+
+    Tensor *left = slice_tensor(input, 3, 0, 2);
+    Tensor *right = slice_tensor(input, 3, 2, 6);
+    Tensor *right_outer = slice_tensor(right, 3, 0, 4);
+    Tensor *concatenated = create_tensor(input->n_dims, input->dims);
+
+    concat_tensors_into(concatenated, 3, 2, (const Tensor *const[]) {left, right_outer});
+
+    printf("LAST DIM CONCAT DIFF: %f\n", (double) max_abs_difference(concatenated, input));
+    assert(max_abs_difference(concatenated, input) == 0);
+
+    // Run ops on a non-contiguous slice and compare with its copy
+
+    Tensor *flat_input = reshape_tensor(input, 2, (size_t[]) {4, 3 * 6 * 6});
+    Tensor *features = slice_tensor(flat_input, 1, 10, 30);
+    Tensor *features_copy = copy_tensor(features);
+
+    assert(!is_tensor_contiguous(features));
+
+    Tensor *linear_weight = create_tensor(2, (size_t[]) {7, 20});
+    Tensor *linear_bias = create_tensor(1, (size_t[]) {7});
+
+    fill_tensor(linear_weight, 4);
+    fill_tensor(linear_bias, 5);
+
+    Tensor *strided_output = linear(features, linear_weight, linear_bias);
+    Tensor *copied_output = linear(features_copy, linear_weight, linear_bias);
+
+    printf("STRIDED LINEAR DIFF: %f\n", (double) max_abs_difference(strided_output, copied_output));
+    assert(max_abs_difference(strided_output, copied_output) == 0);
+
+    // Top-k on a batch slice of the strided features
+
+    Tensor *features_tail = slice_tensor(features, 0, 1, 4);
+    Tensor *features_tail_copy = copy_tensor(features_tail);
+
+    size_t strided_indices[3 * 2], copied_indices[3 * 2];
+    float strided_probabilities[3 * 2], copied_probabilities[3 * 2];
+
+    linear_softmax_top_k(features_tail, linear_weight, linear_bias, 2, strided_indices, strided_probabilities);
+    linear_softmax_top_k(features_tail_copy, linear_weight, linear_bias, 2, copied_indices, copied_probabilities);
+
+    for (size_t i = 0; i < 3 * 2; i++) {
+        assert(strided_indices[i] == copied_indices[i]);
+        assert(strided_probabilities[i] == copied_probabilities[i]);
+    }
+
+    destroy_tensor(features_tail_copy);
+    destroy_tensor(features_tail);
+    destroy_tensor(copied_output);
+    destroy_tensor(strided_output);
+    destroy_tensor(linear_bias);
+    destroy_tensor(linear_weight);
+    destroy_tensor(features_copy);
+    destroy_tensor(features);
+    destroy_tensor(flat_input);
+    destroy_tensor(concatenated);
+    destroy_tensor(right_outer);
+    destroy_tensor(right);
+    destroy_tensor(left);
+    destroy_tensor(batched_output);
+
+    for (size_t i = 0; i < 2; i++) {
+        destroy_tensor(request_outputs[i]);
+        destroy_tensor(requests[i]);
+    }
+
+    destroy_tensor(full_output);
+    destroy_tensor(bias);
+    destroy_tensor(weight);
+    destroy_tensor(input);
+}
+
+// Loss of conv -> relu -> max pool -> linear -> softmax cross-entropy, where
+// parameters holds {input, conv weight, conv bias, linear weight, linear bias}.
+// If gradients is not NULL it receives the gradient of every parameter.
+static float classifier_loss(Tensor *const *parameters, const size_t *targets, Tensor **gradients) {
+    const Tensor *input = parameters[0];
+    size_t batch_size = input->dims[0];
+
+    Tensor *conv = conv_2d(input, parameters[1], parameters[2], 1);
+    Tensor *activation = relu(conv);
+
+    size_t *argmax = malloc(get_tensor_element_count(activation) * sizeof *argmax);
+    assert(argmax != NULL);
+
+    Tensor *pooled = max_pool_2d_with_argmax(activation, 2, 2, argmax);
+    Tensor *features = reshape_tensor(pooled, 2, (size_t[]) {batch_size, get_tensor_element_count(pooled) / batch_size});
+    Tensor *logits = linear(features, parameters[3], parameters[4]);
+
+    Tensor *grad_logits;
+    float loss = softmax_cross_entropy(logits, targets, gradients != NULL ? &grad_logits : NULL);
+
+    if (gradients != NULL) {
+        Tensor *grad_features;
+        linear_backward(features, parameters[3], grad_logits, &grad_features, &gradients[3], &gradients[4]);
+
+        Tensor *grad_pooled = reshape_tensor(grad_features, pooled->n_dims, pooled->dims);
+        Tensor *grad_activation = max_pool_2d_backward(activation, grad_pooled, argmax);
+        Tensor *grad_conv = relu_backward(conv, grad_activation);
+
+        conv_2d_backward(input, parameters[1], grad_conv, 1, &gradients[0], &gradients[1], &gradients[2]);
+
+        destroy_tensor(grad_conv);
+        destroy_tensor(grad_activation);
+        destroy_tensor(grad_pooled);
+        destroy_tensor(grad_features);
+        destroy_tensor(grad_logits);
+    }
+
+    destroy_tensor(logits);
+    destroy_tensor(features);
+    destroy_tensor(pooled);
+    free(argmax);
+    destroy_tensor(activation);
+    destroy_tensor(conv);
+
+    return loss;
+}
+
+static void check_backward(void) {
+    Tensor *parameters[] = {
+        create_tensor(4, (size_t[]) {3, 2, 9, 9}),
+        create_tensor(4, (size_t[]) {4, 2, 3, 3}),
+        create_tensor(1, (size_t[]) {4}),
+        create_tensor(2, (size_t[]) {5, 4 * 3 * 3}),
+        create_tensor(1, (size_t[]) {5})
+    };
+    size_t n_parameters = sizeof parameters / sizeof *parameters;
+    size_t targets[] = {1, 4, 2};
+
+    for (size_t i = 0; i < n_parameters; i++) {
+        fill_tensor(parameters[i], i + 1);
+    }
+
+    // Compare every gradient against central finite differences
+
+    Tensor *gradients[5];
+    float initial_loss = classifier_loss(parameters, targets, gradients);
+
+    float epsilon = 1e-3f;
+
+    for (size_t i = 0; i < n_parameters; i++) {
+        float max_difference = 0;
+
+        for (size_t j = 0; j < get_tensor_element_count(parameters[i]); j++) {
+            float original_value = parameters[i]->data[j];
+
+            parameters[i]->data[j] = original_value + epsilon;
+            float loss_plus = classifier_loss(parameters, targets, NULL);
+            parameters[i]->data[j] = original_value - epsilon;
+            float loss_minus = classifier_loss(parameters, targets, NULL);
+            parameters[i]->data[j] = original_value;
+
+            float numerical_gradient = (loss_plus - loss_minus) / (2 * epsilon);
+            float difference = fabsf(numerical_gradient - gradients[i]->data[j]);
+
+            max_difference = max_difference > difference ? max_difference : difference;
+        }
+
+        printf("GRADIENT %zu MAX DIFF: %f\n", i, (double) max_difference);
+        assert(max_difference < 1e-2f);
+    }
+
+    for (size_t i = 0; i < n_parameters; i++) {
+        destroy_tensor(gradients[i]);
+    }
+
+    // Fine-tune the weights with Adam and the biases with SGD
+
+    AdamState *conv_state = create_adam_state(parameters[1]);
+    AdamState *linear_state = create_adam_state(parameters[3]);
+
+    float loss = initial_loss;
+
+    for (size_t step = 0; step < 50; step++) {
+        loss = classifier_loss(parameters, targets, gradients);
+
+        adam_step(parameters[1], gradients[1], conv_state, 0.01f, 0.9f, 0.999f, 1e-8f);
+        sgd_step(parameters[2], gradients[2], 0.1f);
+        adam_step(parameters[3], gradients[3], linear_state, 0.01f, 0.9f, 0.999f, 1e-8f);
+        sgd_step(parameters[4], gradients[4], 0.1f);
+
+        for (size_t i = 0; i < n_parameters; i++) {
+            destroy_tensor(gradients[i]);
+        }
+    }
+
+    printf("LOSS: %f -> %f\n", (double) initial_loss, (double) loss);
+    assert(loss < initial_loss);
+
+    destroy_adam_state(conv_state);
+    destroy_adam_state(linear_state);
+
+    for (size_t i = 0; i < n_parameters; i++) {
+        destroy_tensor(parameters[i]);
+    }
+}
+
+// Direct loops over every output position, accumulated in double
+static void reference_conv_2d_backward(const Tensor *input, const Tensor *weight, const Tensor *grad_output, size_t stride, Tensor *grad_input, Tensor *grad_weight, Tensor *grad_bias) {
+    size_t batch_size = input->dims[0], input_channels = input->dims[1], input_height = input->dims[2], input_width = input->dims[3];
+    size_t output_channels = weight->dims[0], kernel_height = weight->dims[2], kernel_width = weight->dims[3];
+    size_t output_height = grad_output->dims[2], output_width = grad_output->dims[3];
+
+    double *input_sums = calloc(get_tensor_element_count(input), sizeof *input_sums);
+    assert(input_sums != NULL);
+
+    for (size_t o = 0; o < output_channels; o++) {
+        double bias_sum = 0;
+
+        for (size_t b = 0; b < batch_size; b++) {
+            for (size_t j = 0; j < output_height; j++) {
+                for (size_t k = 0; k < output_width; k++) {
+                    bias_sum += (double) grad_output->data[((b * output_channels + o) * output_height + j) * output_width + k];
+                }
+            }
+        }
+
+        grad_bias->data[o] = (float) bias_sum;
+
+        for (size_t c = 0; c < input_channels; c++) {
+            for (size_t l = 0; l < kernel_height; l++) {
+                for (size_t m = 0; m < kernel_width; m++) {
+                    size_t weight_index = ((o * input_channels + c) * kernel_height + l) * kernel_width + m;
+                    double weight_sum = 0;
+
+                    for (size_t b = 0; b < batch_size; b++) {
+                        for (size_t j = 0; j < output_height; j++) {
+                            for (size_t k = 0; k < output_width; k++) {
+                                size_t input_index = ((b * input_channels + c) * input_height + j * stride + l) * input_width + k * stride + m;
+                                double grad_value = (double) grad_output->data[((b * output_channels + o) * output_height + j) * output_width + k];
+
+                                weight_sum += grad_value * (double) input->data[input_index];
+                                input_sums[input_index] += grad_value * (double) weight->data[weight_index];
+                            }
+                        }
+                    }
+
+                    grad_weight->data[weight_index] = (float) weight_sum;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < get_tensor_element_count(input); i++) {
+        grad_input->data[i] = (float) input_sums[i];
+    }
+
+    free(input_sums);
+}
+
+static void reference_linear_backward(const Tensor *input, const Tensor *weight, const Tensor *grad_output, Tensor *grad_input, Tensor *grad_weight, Tensor *grad_bias) {
+    size_t batch_size = input->dims[0], input_size = input->dims[1], output_size = weight->dims[0];
+
+    for (size_t i = 0; i < output_size; i++) {
+        double bias_sum = 0;
+
+        for (size_t b = 0; b < batch_size; b++) {
+            bias_sum += (double) grad_output->data[b * output_size + i];
+        }
+
+        grad_bias->data[i] = (float) bias_sum;
+
+        for (size_t j = 0; j < input_size; j++) {
+            double weight_sum = 0;
+
+            for (size_t b = 0; b < batch_size; b++) {
+                weight_sum += (double) grad_output->data[b * output_size + i] * (double) input->data[b * input_size + j];
+            }
+
+            grad_weight->data[i * input_size + j] = (float) weight_sum;
+        }
+    }
+
+    for (size_t b = 0; b < batch_size; b++) {
+        for (size_t j = 0; j < input_size; j++) {
+            double input_sum = 0;
+
+            for (size_t i = 0; i < output_size; i++) {
+                input_sum += (double) grad_output->data[b * output_size + i] * (double) weight->data[i * input_size + j];
+            }
+
+            grad_input->data[b * input_size + j] = (float) input_sum;
+        }
+    }
+}
+
+static void check_backward_against_reference(void) {
+    // Wide enough that conv_2d_backward splits both passes into several tiles
+    // of output rows (patch_size * output_width = 500 * 148 floats per row)
+
+    size_t stride = 2;
+
+    Tensor *input = create_tensor(4, (size_t[]) {2, 20, 41, 300});
+    Tensor *weight = create_tensor(4, (size_t[]) {3, 20, 5, 5});
+    Tensor *grad_output = create_tensor(4, (size_t[]) {2, 3, 19, 148});
+
+    fill_tensor(input, 1);
+    fill_tensor(weight, 2);
+    fill_tensor(grad_output, 3);
+
+    Tensor *grad_input, *grad_weight, *grad_bias;
+    conv_2d_backward(input, weight, grad_output, stride, &grad_input, &grad_weight, &grad_bias);
+
+    Tensor *reference_input = create_tensor(input->n_dims, input->dims);
+    Tensor *reference_weight = create_tensor(weight->n_dims, weight->dims);
+    Tensor *reference_bias = create_tensor(1, (size_t[]) {3});
+    reference_conv_2d_backward(input, weight, grad_output, stride, reference_input, reference_weight, reference_bias);
+
+    float conv_difference = max_abs_difference(grad_input, reference_input);
+    conv_difference = fmaxf(conv_difference, max_abs_difference(grad_weight, reference_weight));
+    conv_difference = fmaxf(conv_difference, max_abs_difference(grad_bias, reference_bias));
+
+    printf("TILED CONV BACKWARD DIFF: %f\n", (double) conv_difference);
+    assert(conv_difference < 1e-2f);
+
+    destroy_tensor(reference_bias);
+    destroy_tensor(reference_weight);
+    destroy_tensor(reference_input);
+    destroy_tensor(grad_bias);
+    destroy_tensor(grad_weight);
+    destroy_tensor(grad_input);
+    destroy_tensor(grad_output);
+    destroy_tensor(weight);
+    destroy_tensor(input);
+
+    // linear_backward uses per-thread accumulators when the batch has a row for
+    // every thread and splits over weight rows and input columns otherwise
+
+    Tensor *linear_input = create_tensor(2, (size_t[]) {4, 150});
+    Tensor *linear_weight = create_tensor(2, (size_t[]) {30, 150});
+    Tensor *linear_grad_output = create_tensor(2, (size_t[]) {4, 30});
+
+    fill_tensor(linear_input, 4);
+    fill_tensor(linear_weight, 5);
+    fill_tensor(linear_grad_output, 6);
+
+    Tensor *reference_linear_input = create_tensor(2, linear_input->dims);
+    Tensor *reference_linear_weight = create_tensor(2, linear_weight->dims);
+    Tensor *reference_linear_bias = create_tensor(1, (size_t[]) {30});
+    reference_linear_backward(linear_input, linear_weight, linear_grad_output, reference_linear_input, reference_linear_weight, reference_linear_bias);
+
+#ifdef _OPENMP
+    int saved_threads = omp_get_max_threads();
+    int thread_counts[] = {2, 8};
+#else
+    int thread_counts[] = {1};
+#endif
+
+    for (size_t i = 0; i < sizeof thread_counts / sizeof *thread_counts; i++) {
+#ifdef _OPENMP
+        omp_set_num_threads(thread_counts[i]);
+#endif
+
+        Tensor *linear_grad_input, *linear_grad_weight, *linear_grad_bias;
+        linear_backward(linear_input, linear_weight, linear_grad_output, &linear_grad_input, &linear_grad_weight, &linear_grad_bias);
+
+        float linear_difference = max_abs_difference(linear_grad_input, reference_linear_input);
+        linear_difference = fmaxf(linear_difference, max_abs_difference(linear_grad_weight, reference_linear_weight));
+        linear_difference = fmaxf(linear_difference, max_abs_difference(linear_grad_bias, reference_linear_bias));
+
+        printf("LINEAR BACKWARD DIFF (%d THREADS): %f\n", thread_counts[i], (double) linear_difference);
+        assert(linear_difference < 1e-4f);
+
+        destroy_tensor(linear_grad_bias);
+        destroy_tensor(linear_grad_weight);
+        destroy_tensor(linear_grad_input);
+    }
+
+#ifdef _OPENMP
+    omp_set_num_threads(saved_threads);
+#endif
+
+    destroy_tensor(reference_linear_bias);
+    destroy_tensor(reference_linear_weight);
+    destroy_tensor(reference_linear_input);
+    destroy_tensor(linear_grad_output);
+    destroy_tensor(linear_weight);
+    destroy_tensor(linear_input);
+}
+
 int main(int argc, char *argv[]) {
+    // Check the fused classifier head against softmax(linear(...))
+
+    check_linear_softmax_top_k();
+
+    // Check strided views against their copied equivalents
+
+    check_tensor_views();
+
+    // Check the backward kernels and run a few training steps
+
+    check_backward();
+
+    check_backward_against_reference();
+
     // Test softmax
 
     size_t tensor_dims [] = {3};
@@ -53,6 +601,17 @@ int main(int argc, char *argv[]) {
 
     print_tensor(output2);
 
+    // Try the fused classifier head on the same layer
+
+    size_t top_indices[2 * 2];
+    float top_probabilities[2 * 2];
+
+    linear_softmax_top_k(input2, weight, bias, 2, top_indices, top_probabilities);
+
+    for (size_t i = 0; i < 2 * 2; i++) {
+        printf("TOP-K %zu: class %zu, p = %f\n", i, top_indices[i], (double) top_probabilities[i]);
+    }
+
     size_t weight_indices[] = {1, 2};
     float val = get_tensor_entry_value(weight, weight_indices);
     printf("VAL: %f\n", (double)val);
@@ -1,47 +1,46 @@
 #include "nn.h"
 #include "tensor.h"
 
-Tensor *remove_batch_size_if_present_from_3d_tensor(Tensor *t, bool has_batch_dim) {
-    assert(t->n_dims == 4);
+// Returns t itself if it is contiguous and a contiguous copy otherwise, so
+// the kernels below can keep indexing t->data with flat indices
+static const Tensor *get_contiguous_tensor(const Tensor *t) {
+    assert(t != NULL);
 
-    if (has_batch_dim) {
-        return t;
-    } else {
-        size_t channels = t->dims[1];
-        size_t height = t->dims[2];
-        size_t width = t->dims[3];
+    return is_tensor_contiguous(t) ? t : copy_tensor(t);
+}
 
-        t->n_dims = 3;
-        free(t->dims);
-        t->dims = malloc(3 * sizeof *t->dims);
-        assert(t->dims != NULL);
+static void release_contiguous_tensor(const Tensor *original, const Tensor *contiguous) {
+    if (contiguous != original) {
+        destroy_tensor((Tensor *) contiguous);
+    }
+}
 
-        t->dims[0] = channels;
-        t->dims[1] = height;
-        t->dims[2] = width;
+// Drops the leading dimension in place, without reallocating dims
+static Tensor *remove_leading_dim(Tensor *t) {
+    for (size_t i = 0; i + 1 < t->n_dims; i++) {
+        t->dims[i] = t->dims[i + 1];
 
-        return t;
+        if (t->strides != NULL) {
+            t->strides[i] = t->strides[i + 1];
+        }
     }
+
+    t->n_dims--;
+
+    return t;
+}
+
+Tensor *remove_batch_size_if_present_from_3d_tensor(Tensor *t, bool has_batch_dim) {
+    assert(t->n_dims == 4);
+
+    return has_batch_dim ? t : remove_leading_dim(t);
 }
 
 // CHECKED
 Tensor *remove_batch_size_if_present_from_1d_tensor(Tensor *t, bool has_batch_dim) {
     assert(t->n_dims == 2);
 
-    if (has_batch_dim) {
-        return t;
-    } else {
-        size_t num_entries = t->dims[1];
-
-        t->n_dims = 1;
-        free(t->dims);
-        t->dims = malloc(1 * sizeof *t->dims);
-        assert(t->dims != NULL);
-        
-        t->dims[0] = num_entries;
-
-        return t;
-    }
+    return has_batch_dim ? t : remove_leading_dim(t);
 }
 
 // CHECKED
@@ -50,6 +49,11 @@ Tensor *conv_2d(const Tensor *input, const Tensor *weight, const Tensor *bias, s
     assert(weight != NULL);
     assert(bias != NULL);
 
+    const Tensor *input_view = input, *weight_view = weight, *bias_view = bias;
+    input = get_contiguous_tensor(input_view);
+    weight = get_contiguous_tensor(weight_view);
+    bias = get_contiguous_tensor(bias_view);
+
     bool has_batch_dim = input->n_dims == 4;
 
     assert(has_batch_dim || input->n_dims == 3);
@@ -129,13 +133,27 @@ Tensor *conv_2d(const Tensor *input, const Tensor *weight, const Tensor *bias, s
         }
     }
 
+    release_contiguous_tensor(input_view, input);
+    release_contiguous_tensor(weight_view, weight);
+    release_contiguous_tensor(bias_view, bias);
+
     return remove_batch_size_if_present_from_3d_tensor(output, has_batch_dim);
 }
 
 // CHECKED
 Tensor *max_pool_2d(const Tensor *input, size_t pool_size, size_t stride) {
+    return max_pool_2d_with_argmax(input, pool_size, stride, NULL);
+}
+
+// Same as max_pool_2d, but also stores for every output entry the flat index
+// of the input entry it was taken from, as needed by max_pool_2d_backward.
+// argmax can be NULL; otherwise it must hold one entry per output element.
+Tensor *max_pool_2d_with_argmax(const Tensor *input, size_t pool_size, size_t stride, size_t *argmax) {
     assert(input != NULL);
 
+    const Tensor *input_view = input;
+    input = get_contiguous_tensor(input_view);
+
     bool has_batch_dim = input->n_dims == 4;
 
     assert(has_batch_dim || input->n_dims == 3);
@@ -169,6 +187,7 @@ Tensor *max_pool_2d(const Tensor *input, size_t pool_size, size_t stride) {
                     output_index = oi_batch_size + oi_output_channels + oi_output_height + oi_output_width;
 
                     float max_value = -INFINITY;
+                    size_t max_index = ii_batch_size + ii_input_channels + j * stride * input_width + k * stride;
 
                     for (size_t l = 0; l < pool_size; l++) {
                         ii_input_height = (j * stride + l) * input_width;
@@ -178,16 +197,26 @@ Tensor *max_pool_2d(const Tensor *input, size_t pool_size, size_t stride) {
 
                             float current_value = input->data[input_index];
 
-                            max_value = max_value > current_value ? max_value : current_value;
+                            // Written as the negation so NaN inputs are picked like before
+                            if (!(max_value > current_value)) {
+                                max_value = current_value;
+                                max_index = input_index;
+                            }
                         }
                     }
 
                     output->data[output_index] = max_value;
+
+                    if (argmax != NULL) {
+                        argmax[output_index] = max_index;
+                    }
                 }
             }
         }
     }
 
+    release_contiguous_tensor(input_view, input);
+
     return remove_batch_size_if_present_from_3d_tensor(output, has_batch_dim);
 }
 
@@ -195,6 +224,9 @@ Tensor *max_pool_2d(const Tensor *input, size_t pool_size, size_t stride) {
 Tensor *relu (const Tensor *input) {
     assert(input != NULL);
 
+    const Tensor *input_view = input;
+    input = get_contiguous_tensor(input_view);
+
     Tensor *output = create_tensor(input->n_dims, input->dims);
 
     size_t num_elements = get_tensor_element_count(input);
@@ -203,6 +235,8 @@ Tensor *relu (const Tensor *input) {
         output->data[i] = input->data[i] > 0 ? input->data[i] : 0;
     }
 
+    release_contiguous_tensor(input_view, input);
+
     return output;
 }
 
@@ -217,6 +251,7 @@ Tensor *conv_relu_max_pool_2d(const Tensor *input, const Tensor *weight, const T
     return max_pool;
 }
 
+// Always copies; use reshape_tensor for a zero-copy flatten of a contiguous tensor
 Tensor *flatten(const Tensor *input, bool has_batch_dim) {
     Tensor *copy = copy_tensor(input);
 
@@ -250,6 +285,11 @@ Tensor *linear(const Tensor *input, const Tensor *weight, const Tensor *bias) {
     assert(weight != NULL);
     assert(bias != NULL);
 
+    const Tensor *input_view = input, *weight_view = weight, *bias_view = bias;
+    input = get_contiguous_tensor(input_view);
+    weight = get_contiguous_tensor(weight_view);
+    bias = get_contiguous_tensor(bias_view);
+
     bool has_batch_dim = input->n_dims == 2;
 
     assert(has_batch_dim || input->n_dims == 1);
@@ -288,6 +328,10 @@ Tensor *linear(const Tensor *input, const Tensor *weight, const Tensor *bias) {
         }
     }
 
+    release_contiguous_tensor(input_view, input);
+    release_contiguous_tensor(weight_view, weight);
+    release_contiguous_tensor(bias_view, bias);
+
     return remove_batch_size_if_present_from_1d_tensor(output, has_batch_dim);
 }
 
@@ -295,6 +339,9 @@ Tensor *linear(const Tensor *input, const Tensor *weight, const Tensor *bias) {
 Tensor *softmax(const Tensor *input) {
     assert(input != NULL);
 
+    const Tensor *input_view = input;
+    input = get_contiguous_tensor(input_view);
+
     bool has_batch_dim = input->n_dims == 2;
 
     assert(has_batch_dim || input->n_dims == 1);
@@ -324,5 +371,811 @@ Tensor *softmax(const Tensor *input) {
         }
     }
 
+    release_contiguous_tensor(input_view, input);
+
     return remove_batch_size_if_present_from_1d_tensor(output, has_batch_dim);
-}
\ No newline at end of file
+}
+
+// Number of logits computed at once by linear_softmax_top_k before they are
+// folded into the running max, sum and top-k heap of the current row
+#define CLASSIFIER_TILE_SIZE 256
+
+static void sift_down_top_k_heap(float *logits, size_t *indices, size_t size, size_t position) {
+    // Min-heap on logits, so the root is always the weakest of the current top-k
+    while (true) {
+        size_t left = 2 * position + 1;
+        size_t right = left + 1;
+        size_t smallest = position;
+
+        if (left < size && logits[left] < logits[smallest]) {
+            smallest = left;
+        }
+
+        if (right < size && logits[right] < logits[smallest]) {
+            smallest = right;
+        }
+
+        if (smallest == position) {
+            return;
+        }
+
+        float tmp_logit = logits[position];
+        logits[position] = logits[smallest];
+        logits[smallest] = tmp_logit;
+
+        size_t tmp_index = indices[position];
+        indices[position] = indices[smallest];
+        indices[smallest] = tmp_index;
+
+        position = smallest;
+    }
+}
+
+// Computes softmax(linear(input, weight, bias)) but only keeps the k most
+// probable classes per batch row. Logits are produced tile by tile while a
+// running max and sum of exponentials (online log-sum-exp) and a top-k heap
+// are maintained, so the full output is never materialized.
+//
+// top_indices and top_probabilities must both hold batch_size * k entries;
+// row b is written to [b * k, (b + 1) * k) in order of decreasing probability.
+void linear_softmax_top_k(const Tensor *input, const Tensor *weight, const Tensor *bias, size_t k, size_t *top_indices, float *top_probabilities) {
+    assert(input != NULL);
+    assert(weight != NULL);
+    assert(bias != NULL);
+    assert(top_indices != NULL);
+    assert(top_probabilities != NULL);
+
+    const Tensor *input_view = input, *weight_view = weight, *bias_view = bias;
+    input = get_contiguous_tensor(input_view);
+    weight = get_contiguous_tensor(weight_view);
+    bias = get_contiguous_tensor(bias_view);
+
+    bool has_batch_dim = input->n_dims == 2;
+
+    assert(has_batch_dim || input->n_dims == 1);
+
+    size_t batch_size = has_batch_dim ? input->dims[0] : 1;
+    size_t input_size = input->dims[0+has_batch_dim];
+
+    assert(weight->n_dims == 2);
+
+    size_t output_size = weight->dims[0];
+    size_t weight_input_size = weight->dims[1];
+    size_t bias_size = bias->dims[0];
+
+    assert(input_size == weight_input_size);
+
+    assert(bias->n_dims == 1);
+    assert(bias_size == output_size);
+
+    assert(k > 0 && k <= output_size);
+
+    size_t b;
+    #pragma omp parallel for private(b)
+    for (b = 0; b < batch_size; b++) {
+        const float *input_row = &input->data[b * input_size];
+
+        // The heap lives in the caller's output buffers; logits are stored in
+        // place of the probabilities until the row is finished
+        float *heap_logits = &top_probabilities[b * k];
+        size_t *heap_indices = &top_indices[b * k];
+        size_t heap_size = 0;
+
+        float tile[CLASSIFIER_TILE_SIZE];
+        float running_max = -INFINITY;
+        float running_sum = 0;
+
+        for (size_t tile_start = 0; tile_start < output_size; tile_start += CLASSIFIER_TILE_SIZE) {
+            size_t tile_end = tile_start + CLASSIFIER_TILE_SIZE < output_size ? tile_start + CLASSIFIER_TILE_SIZE : output_size;
+            float tile_max = -INFINITY;
+
+            for (size_t i = tile_start; i < tile_end; i++) {
+                const float *weight_row = &weight->data[i * input_size];
+                float new_value = 0.0;
+
+                for (size_t j = 0; j < input_size; j++) {
+                    new_value += input_row[j] * weight_row[j];
+                }
+
+                new_value += bias->data[i];
+                tile[i - tile_start] = new_value;
+                tile_max = tile_max > new_value ? tile_max : new_value;
+            }
+
+            // Rescale the sum accumulated so far to the new maximum
+            if (tile_max > running_max) {
+                running_sum *= expf(running_max - tile_max);
+                running_max = tile_max;
+            }
+
+            for (size_t i = tile_start; i < tile_end; i++) {
+                float logit = tile[i - tile_start];
+
+                running_sum += expf(logit - running_max);
+
+                if (heap_size < k) {
+                    heap_logits[heap_size] = logit;
+                    heap_indices[heap_size] = i;
+                    heap_size++;
+
+                    if (heap_size == k) {
+                        for (size_t p = k / 2; p-- > 0;) {
+                            sift_down_top_k_heap(heap_logits, heap_indices, k, p);
+                        }
+                    }
+                } else if (logit > heap_logits[0]) {
+                    heap_logits[0] = logit;
+                    heap_indices[0] = i;
+                    sift_down_top_k_heap(heap_logits, heap_indices, k, 0);
+                }
+            }
+        }
+
+        // Pop the heap from the back so the row ends up sorted in decreasing order
+        for (size_t end = k; end-- > 1;) {
+            float tmp_logit = heap_logits[0];
+            heap_logits[0] = heap_logits[end];
+            heap_logits[end] = tmp_logit;
+
+            size_t tmp_index = heap_indices[0];
+            heap_indices[0] = heap_indices[end];
+            heap_indices[end] = tmp_index;
+
+            sift_down_top_k_heap(heap_logits, heap_indices, end, 0);
+        }
+
+        for (size_t i = 0; i < k; i++) {
+            heap_logits[i] = expf(heap_logits[i] - running_max) / running_sum;
+        }
+    }
+
+    release_contiguous_tensor(input_view, input);
+    release_contiguous_tensor(weight_view, weight);
+    release_contiguous_tensor(bias_view, bias);
+}
+
+// Target number of floats in one im2col buffer of conv_2d_backward; the image
+// is processed in tiles of output rows so scratch memory does not grow with it
+#define CONV_BACKWARD_TILE_ELEMENTS 65536
+
+// Number of input columns handled per task when linear_backward splits the
+// input gradient over columns
+#define LINEAR_BACKWARD_COLUMN_BLOCK 64
+
+// Row-major GEMM helpers for the backward kernels; all of them accumulate
+// into c, take BLAS-style leading dimensions so they can work on sub-matrices
+// and are meant to be called from within a parallel region
+
+// c (m x n) += a (m x k) * b (k x n)
+static void gemm_nn(size_t m, size_t n, size_t k, const float *a, size_t lda, const float *b, size_t ldb, float *c, size_t ldc) {
+    for (size_t i = 0; i < m; i++) {
+        for (size_t p = 0; p < k; p++) {
+            float a_value = a[i * lda + p];
+
+            for (size_t j = 0; j < n; j++) {
+                c[i * ldc + j] += a_value * b[p * ldb + j];
+            }
+        }
+    }
+}
+
+// c (m x n) += a (m x k) * b^T, with b stored as (n x k)
+static void gemm_nt(size_t m, size_t n, size_t k, const float *a, size_t lda, const float *b, size_t ldb, float *c, size_t ldc) {
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            float new_value = 0.0;
+
+            for (size_t p = 0; p < k; p++) {
+                new_value += a[i * lda + p] * b[j * ldb + p];
+            }
+
+            c[i * ldc + j] += new_value;
+        }
+    }
+}
+
+// c (m x n) += a^T * b, with a stored as (k x m) and b as (k x n)
+static void gemm_tn(size_t m, size_t n, size_t k, const float *a, size_t lda, const float *b, size_t ldb, float *c, size_t ldc) {
+    for (size_t p = 0; p < k; p++) {
+        for (size_t i = 0; i < m; i++) {
+            float a_value = a[p * lda + i];
+
+            for (size_t j = 0; j < n; j++) {
+                c[i * ldc + j] += a_value * b[p * ldb + j];
+            }
+        }
+    }
+}
+
+// Sums n_accumulators consecutive buffers of size elements into the first one
+// by adding pairs in log2(n_accumulators) parallel rounds
+static void tree_reduce_accumulators(float *accumulators, size_t n_accumulators, size_t size) {
+    for (size_t step = 1; step < n_accumulators; step *= 2) {
+        size_t n_pairs = (n_accumulators - step + 2 * step - 1) / (2 * step);
+
+        size_t pair;
+        #pragma omp parallel for collapse(2) private(pair)
+        for (pair = 0; pair < n_pairs; pair++) {
+            for (size_t i = 0; i < size; i++) {
+                size_t target = pair * 2 * step;
+
+                accumulators[target * size + i] += accumulators[(target + step) * size + i];
+            }
+        }
+    }
+}
+
+// Unrolls the receptive fields of output rows [row_start, row_start + row_count)
+// of one (channels x height x width) input into a (channels * kernel_height *
+// kernel_width) x (row_count * output_width) matrix, so the convolution over
+// that tile becomes a single GEMM
+static void im2col(const float *input, size_t channels, size_t input_height, size_t input_width, size_t kernel_height, size_t kernel_width, size_t stride, size_t output_width, size_t row_start, size_t row_count, float *columns) {
+    size_t tile_area = row_count * output_width;
+
+    for (size_t c = 0; c < channels; c++) {
+        for (size_t l = 0; l < kernel_height; l++) {
+            for (size_t m = 0; m < kernel_width; m++) {
+                float *column_row = &columns[((c * kernel_height + l) * kernel_width + m) * tile_area];
+
+                for (size_t j = 0; j < row_count; j++) {
+                    const float *input_row = &input[(c * input_height + (row_start + j) * stride + l) * input_width + m];
+
+                    for (size_t k = 0; k < output_width; k++) {
+                        column_row[j * output_width + k] = input_row[k * stride];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Inverse of im2col; overlapping receptive fields are summed into input
+static void col2im(const float *columns, size_t channels, size_t input_height, size_t input_width, size_t kernel_height, size_t kernel_width, size_t stride, size_t output_width, size_t row_start, size_t row_count, float *input) {
+    size_t tile_area = row_count * output_width;
+
+    for (size_t c = 0; c < channels; c++) {
+        for (size_t l = 0; l < kernel_height; l++) {
+            for (size_t m = 0; m < kernel_width; m++) {
+                const float *column_row = &columns[((c * kernel_height + l) * kernel_width + m) * tile_area];
+
+                for (size_t j = 0; j < row_count; j++) {
+                    float *input_row = &input[(c * input_height + (row_start + j) * stride + l) * input_width + m];
+
+                    for (size_t k = 0; k < output_width; k++) {
+                        input_row[k * stride] += column_row[j * output_width + k];
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Number of output rows per im2col tile with rows_per_column entries per output position
+static size_t get_conv_tile_rows(size_t rows_per_column, size_t output_width, size_t output_height) {
+    size_t tile_rows = CONV_BACKWARD_TILE_ELEMENTS / (rows_per_column * output_width);
+
+    tile_rows = tile_rows > 0 ? tile_rows : 1;
+
+    return tile_rows < output_height ? tile_rows : output_height;
+}
+
+// Thread queries for the backward kernels; without OpenMP the pragmas are
+// ignored and everything runs on a single thread 0
+static size_t get_max_threads(void) {
+#ifdef _OPENMP
+    return (size_t) omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static size_t get_thread_num(void) {
+#ifdef _OPENMP
+    return (size_t) omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+static Tensor *create_zero_tensor(size_t n_dims, const size_t *dims) {
+    Tensor *t = create_tensor(n_dims, dims);
+
+    size_t num_elements = get_tensor_element_count(t);
+
+    for (size_t i = 0; i < num_elements; i++) {
+        t->data[i] = 0;
+    }
+
+    return t;
+}
+
+// Gradients of conv_2d with respect to its weight, bias and (if grad_input is
+// not NULL) its input.
+//
+// The weight and bias gradients are split over (batch entry, tile of output
+// rows) pairs, so a batch of one still keeps all threads busy. Every thread
+// gets one im2col tile of about CONV_BACKWARD_TILE_ELEMENTS floats (but at
+// least one output row) and its own weight/bias accumulator; the accumulators
+// are combined afterwards with a tree reduction. No more buffers are allocated
+// than there are tasks. The input gradient is split over (batch entry, input
+// channel) pairs, which write to disjoint planes and need no reduction.
+void conv_2d_backward(const Tensor *input, const Tensor *weight, const Tensor *grad_output, size_t stride, Tensor **grad_input, Tensor **grad_weight, Tensor **grad_bias) {
+    assert(input != NULL);
+    assert(weight != NULL);
+    assert(grad_output != NULL);
+    assert(grad_weight != NULL);
+    assert(grad_bias != NULL);
+
+    const Tensor *input_view = input, *weight_view = weight, *grad_output_view = grad_output;
+    input = get_contiguous_tensor(input_view);
+    weight = get_contiguous_tensor(weight_view);
+    grad_output = get_contiguous_tensor(grad_output_view);
+
+    bool has_batch_dim = input->n_dims == 4;
+
+    assert(has_batch_dim || input->n_dims == 3);
+    assert(grad_output->n_dims == input->n_dims);
+
+    size_t batch_size = has_batch_dim ? input->dims[0] : 1;
+    size_t input_channels = input->dims[0+has_batch_dim];
+    size_t input_height = input->dims[1+has_batch_dim];
+    size_t input_width = input->dims[2+has_batch_dim];
+
+    assert(weight->n_dims == 4);
+
+    size_t output_channels = weight->dims[0];
+    size_t kernel_height = weight->dims[2];
+    size_t kernel_width = weight->dims[3];
+
+    assert(input_channels == weight->dims[1]);
+
+    size_t output_height = (input_height - kernel_height) / stride + 1;
+    size_t output_width = (input_width - kernel_width) / stride + 1;
+
+    assert(!has_batch_dim || grad_output->dims[0] == input->dims[0]);
+    assert(grad_output->dims[0+has_batch_dim] == output_channels);
+    assert(grad_output->dims[1+has_batch_dim] == output_height);
+    assert(grad_output->dims[2+has_batch_dim] == output_width);
+
+    size_t kernel_area = kernel_height * kernel_width;
+    size_t patch_size = input_channels * kernel_area;
+    size_t input_plane_size = input_height * input_width;
+    size_t output_area = output_height * output_width;
+    size_t weight_size = output_channels * patch_size;
+    size_t accumulator_size = weight_size + output_channels;
+
+    size_t n_threads = get_max_threads();
+
+    size_t tile_rows = get_conv_tile_rows(patch_size, output_width, output_height);
+    size_t n_tiles = (output_height + tile_rows - 1) / tile_rows;
+    size_t n_tasks = batch_size * n_tiles;
+    size_t n_buffers = n_threads < n_tasks ? n_threads : n_tasks;
+
+    float *accumulators = calloc(n_buffers * accumulator_size, sizeof *accumulators);
+    float *scratch = malloc(n_buffers * patch_size * tile_rows * output_width * sizeof *scratch);
+    assert(accumulators != NULL);
+    assert(scratch != NULL);
+
+    #pragma omp parallel num_threads((int) n_buffers)
+    {
+        size_t thread = get_thread_num();
+        float *accumulator = &accumulators[thread * accumulator_size];
+        float *columns = &scratch[thread * patch_size * tile_rows * output_width];
+
+        size_t task;
+        #pragma omp for private(task)
+        for (task = 0; task < n_tasks; task++) {
+            size_t b = task / n_tiles;
+            size_t row_start = (task % n_tiles) * tile_rows;
+            size_t row_count = row_start + tile_rows < output_height ? tile_rows : output_height - row_start;
+            size_t tile_area = row_count * output_width;
+
+            const float *grad_output_tile = &grad_output->data[b * output_channels * output_area + row_start * output_width];
+
+            im2col(&input->data[b * input_channels * input_plane_size], input_channels, input_height, input_width, kernel_height, kernel_width, stride, output_width, row_start, row_count, columns);
+
+            // dW (output_channels x patch_size) += dY tile (output_channels x tile_area) * columns^T
+            gemm_nt(output_channels, patch_size, tile_area, grad_output_tile, output_area, columns, tile_area, accumulator, patch_size);
+
+            for (size_t i = 0; i < output_channels; i++) {
+                float sum = 0;
+
+                for (size_t p = 0; p < tile_area; p++) {
+                    sum += grad_output_tile[i * output_area + p];
+                }
+
+                accumulator[weight_size + i] += sum;
+            }
+        }
+    }
+
+    tree_reduce_accumulators(accumulators, n_buffers, accumulator_size);
+
+    *grad_weight = create_tensor(4, weight->dims);
+    *grad_bias = create_tensor(1, (size_t[]) {output_channels});
+
+    for (size_t i = 0; i < weight_size; i++) {
+        (*grad_weight)->data[i] = accumulators[i];
+    }
+
+    for (size_t i = 0; i < output_channels; i++) {
+        (*grad_bias)->data[i] = accumulators[weight_size + i];
+    }
+
+    free(accumulators);
+    free(scratch);
+
+    if (grad_input != NULL) {
+        Tensor *input_gradient = create_zero_tensor(input->n_dims, input->dims);
+
+        size_t input_tile_rows = get_conv_tile_rows(kernel_area, output_width, output_height);
+        size_t n_input_tasks = batch_size * input_channels;
+        size_t n_input_buffers = n_threads < n_input_tasks ? n_threads : n_input_tasks;
+
+        float *grad_scratch = malloc(n_input_buffers * kernel_area * input_tile_rows * output_width * sizeof *grad_scratch);
+        assert(grad_scratch != NULL);
+
+        #pragma omp parallel num_threads((int) n_input_buffers)
+        {
+            float *grad_columns = &grad_scratch[get_thread_num() * kernel_area * input_tile_rows * output_width];
+
+            size_t task;
+            #pragma omp for private(task)
+            for (task = 0; task < n_input_tasks; task++) {
+                size_t b = task / input_channels;
+                size_t c = task % input_channels;
+
+                for (size_t row_start = 0; row_start < output_height; row_start += input_tile_rows) {
+                    size_t row_count = row_start + input_tile_rows < output_height ? input_tile_rows : output_height - row_start;
+                    size_t tile_area = row_count * output_width;
+
+                    for (size_t i = 0; i < kernel_area * tile_area; i++) {
+                        grad_columns[i] = 0;
+                    }
+
+                    // dcolumns of channel c (kernel_area x tile_area) = W[:, c]^T * dY tile
+                    gemm_tn(kernel_area, tile_area, output_channels, &weight->data[c * kernel_area], patch_size, &grad_output->data[b * output_channels * output_area + row_start * output_width], output_area, grad_columns, tile_area);
+
+                    col2im(grad_columns, 1, input_height, input_width, kernel_height, kernel_width, stride, output_width, row_start, row_count, &input_gradient->data[(b * input_channels + c) * input_plane_size]);
+                }
+            }
+        }
+
+        free(grad_scratch);
+
+        *grad_input = input_gradient;
+    }
+
+    release_contiguous_tensor(input_view, input);
+    release_contiguous_tensor(weight_view, weight);
+    release_contiguous_tensor(grad_output_view, grad_output);
+}
+
+// Routes every output gradient back to the input entry that won the max in
+// the forward pass, using the argmax filled in by max_pool_2d_with_argmax
+Tensor *max_pool_2d_backward(const Tensor *input, const Tensor *grad_output, const size_t *argmax) {
+    assert(input != NULL);
+    assert(grad_output != NULL);
+    assert(argmax != NULL);
+
+    const Tensor *grad_output_view = grad_output;
+    grad_output = get_contiguous_tensor(grad_output_view);
+
+    bool has_batch_dim = input->n_dims == 4;
+
+    assert(has_batch_dim || input->n_dims == 3);
+    assert(grad_output->n_dims == input->n_dims);
+
+    size_t batch_size = has_batch_dim ? input->dims[0] : 1;
+    size_t input_channels = input->dims[0 + has_batch_dim];
+    size_t input_area = input->dims[1 + has_batch_dim] * input->dims[2 + has_batch_dim];
+    size_t output_area = grad_output->dims[1 + has_batch_dim] * grad_output->dims[2 + has_batch_dim];
+
+    assert(!has_batch_dim || grad_output->dims[0] == input->dims[0]);
+    assert(grad_output->dims[0 + has_batch_dim] == input_channels);
+
+    Tensor *grad_input = create_zero_tensor(input->n_dims, input->dims);
+
+    // Pooling windows never cross channels, so every plane can be handled
+    // by a different thread without synchronization
+    size_t plane;
+    #pragma omp parallel for private(plane)
+    for (plane = 0; plane < batch_size * input_channels; plane++) {
+        for (size_t i = plane * output_area; i < (plane + 1) * output_area; i++) {
+            assert(argmax[i] / input_area == plane);
+
+            grad_input->data[argmax[i]] += grad_output->data[i];
+        }
+    }
+
+    release_contiguous_tensor(grad_output_view, grad_output);
+
+    return grad_input;
+}
+
+Tensor *relu_backward(const Tensor *input, const Tensor *grad_output) {
+    assert(input != NULL);
+    assert(grad_output != NULL);
+
+    const Tensor *input_view = input, *grad_output_view = grad_output;
+    input = get_contiguous_tensor(input_view);
+    grad_output = get_contiguous_tensor(grad_output_view);
+
+    size_t num_elements = get_tensor_element_count(input);
+
+    assert(num_elements == get_tensor_element_count(grad_output));
+
+    Tensor *grad_input = create_tensor(input->n_dims, input->dims);
+
+    size_t i;
+    #pragma omp parallel for private(i)
+    for (i = 0; i < num_elements; i++) {
+        grad_input->data[i] = input->data[i] > 0 ? grad_output->data[i] : 0;
+    }
+
+    release_contiguous_tensor(input_view, input);
+    release_contiguous_tensor(grad_output_view, grad_output);
+
+    return grad_input;
+}
+
+// Gradients of linear with respect to its weight, bias and (if grad_input is
+// not NULL) its input.
+//
+// Batches of at least one row per thread are split over the batch with
+// per-thread weight/bias accumulators and a tree reduction, like
+// conv_2d_backward. Smaller batches are instead split over the output rows of
+// the weight gradient and over blocks of input columns, so every thread writes
+// its own part of the result and no reduction is needed.
+void linear_backward(const Tensor *input, const Tensor *weight, const Tensor *grad_output, Tensor **grad_input, Tensor **grad_weight, Tensor **grad_bias) {
+    assert(input != NULL);
+    assert(weight != NULL);
+    assert(grad_output != NULL);
+    assert(grad_weight != NULL);
+    assert(grad_bias != NULL);
+
+    const Tensor *input_view = input, *weight_view = weight, *grad_output_view = grad_output;
+    input = get_contiguous_tensor(input_view);
+    weight = get_contiguous_tensor(weight_view);
+    grad_output = get_contiguous_tensor(grad_output_view);
+
+    bool has_batch_dim = input->n_dims == 2;
+
+    assert(has_batch_dim || input->n_dims == 1);
+    assert(grad_output->n_dims == input->n_dims);
+
+    size_t batch_size = has_batch_dim ? input->dims[0] : 1;
+    size_t input_size = input->dims[0+has_batch_dim];
+
+    assert(weight->n_dims == 2);
+
+    size_t output_size = weight->dims[0];
+
+    assert(input_size == weight->dims[1]);
+    assert(!has_batch_dim || grad_output->dims[0] == input->dims[0]);
+    assert(grad_output->dims[0+has_batch_dim] == output_size);
+
+    size_t weight_size = output_size * input_size;
+
+    Tensor *input_gradient = grad_input != NULL ? create_zero_tensor(input->n_dims, input->dims) : NULL;
+
+    size_t n_threads = get_max_threads();
+
+    *grad_weight = create_zero_tensor(2, weight->dims);
+    *grad_bias = create_zero_tensor(1, (size_t[]) {output_size});
+
+    if (batch_size >= n_threads) {
+        size_t accumulator_size = weight_size + output_size;
+
+        float *accumulators = calloc(n_threads * accumulator_size, sizeof *accumulators);
+        assert(accumulators != NULL);
+
+        #pragma omp parallel
+        {
+            float *accumulator = &accumulators[get_thread_num() * accumulator_size];
+
+            size_t b;
+            #pragma omp for private(b)
+            for (b = 0; b < batch_size; b++) {
+                const float *input_row = &input->data[b * input_size];
+                const float *grad_output_row = &grad_output->data[b * output_size];
+
+                // dW (output_size x input_size) += dy^T * x, an outer product per row
+                gemm_tn(output_size, input_size, 1, grad_output_row, output_size, input_row, input_size, accumulator, input_size);
+
+                for (size_t i = 0; i < output_size; i++) {
+                    accumulator[weight_size + i] += grad_output_row[i];
+                }
+
+                if (input_gradient != NULL) {
+                    // dx (1 x input_size) = dy * W
+                    gemm_nn(1, input_size, output_size, grad_output_row, output_size, weight->data, input_size, &input_gradient->data[b * input_size], input_size);
+                }
+            }
+        }
+
+        tree_reduce_accumulators(accumulators, n_threads, accumulator_size);
+
+        for (size_t i = 0; i < weight_size; i++) {
+            (*grad_weight)->data[i] = accumulators[i];
+        }
+
+        for (size_t i = 0; i < output_size; i++) {
+            (*grad_bias)->data[i] = accumulators[weight_size + i];
+        }
+
+        free(accumulators);
+    } else {
+        size_t i;
+        #pragma omp parallel for private(i)
+        for (i = 0; i < output_size; i++) {
+            // dW[i, :] (1 x input_size) = dy[:, i]^T * x
+            gemm_tn(1, input_size, batch_size, &grad_output->data[i], output_size, input->data, input_size, &(*grad_weight)->data[i * input_size], input_size);
+
+            for (size_t b = 0; b < batch_size; b++) {
+                (*grad_bias)->data[i] += grad_output->data[b * output_size + i];
+            }
+        }
+
+        if (input_gradient != NULL) {
+            size_t n_blocks = (input_size + LINEAR_BACKWARD_COLUMN_BLOCK - 1) / LINEAR_BACKWARD_COLUMN_BLOCK;
+
+            size_t block;
+            #pragma omp parallel for private(block)
+            for (block = 0; block < n_blocks; block++) {
+                size_t column_start = block * LINEAR_BACKWARD_COLUMN_BLOCK;
+                size_t column_count = column_start + LINEAR_BACKWARD_COLUMN_BLOCK < input_size ? LINEAR_BACKWARD_COLUMN_BLOCK : input_size - column_start;
+
+                // dx[:, block] (batch_size x column_count) = dy * W[:, block]
+                gemm_nn(batch_size, column_count, output_size, grad_output->data, output_size, &weight->data[column_start], input_size, &input_gradient->data[column_start], input_size);
+            }
+        }
+    }
+
+    if (grad_input != NULL) {
+        *grad_input = input_gradient;
+    }
+
+    release_contiguous_tensor(input_view, input);
+    release_contiguous_tensor(weight_view, weight);
+    release_contiguous_tensor(grad_output_view, grad_output);
+}
+
+// Mean cross-entropy of softmax(logits) against the target class of every
+// batch row. If grad_logits is not NULL it receives the gradient of that mean
+// with respect to the logits, (softmax(logits) - one_hot(targets)) / batch_size.
+float softmax_cross_entropy(const Tensor *logits, const size_t *targets, Tensor **grad_logits) {
+    assert(logits != NULL);
+    assert(targets != NULL);
+
+    const Tensor *logits_view = logits;
+    logits = get_contiguous_tensor(logits_view);
+
+    bool has_batch_dim = logits->n_dims == 2;
+
+    assert(has_batch_dim || logits->n_dims == 1);
+
+    size_t batch_size = has_batch_dim ? logits->dims[0] : 1;
+    size_t input_size = logits->dims[0+has_batch_dim];
+
+    Tensor *gradient = grad_logits != NULL ? create_tensor(logits->n_dims, logits->dims) : NULL;
+
+    float loss = 0;
+
+    size_t b;
+    #pragma omp parallel for private(b) reduction(+:loss)
+    for (b = 0; b < batch_size; b++) {
+        const float *logits_row = &logits->data[b * input_size];
+
+        assert(targets[b] < input_size);
+
+        float max_value = -INFINITY;
+
+        for (size_t i = 0; i < input_size; i++) {
+            max_value = max_value > logits_row[i] ? max_value : logits_row[i];
+        }
+
+        float sum = 0;
+
+        for (size_t i = 0; i < input_size; i++) {
+            sum += expf(logits_row[i] - max_value);
+        }
+
+        float log_sum = logf(sum);
+
+        loss += log_sum - (logits_row[targets[b]] - max_value);
+
+        if (gradient != NULL) {
+            float *gradient_row = &gradient->data[b * input_size];
+
+            for (size_t i = 0; i < input_size; i++) {
+                gradient_row[i] = expf(logits_row[i] - max_value - log_sum) / (float) batch_size;
+            }
+
+            gradient_row[targets[b]] -= 1.0f / (float) batch_size;
+        }
+    }
+
+    if (grad_logits != NULL) {
+        *grad_logits = gradient;
+    }
+
+    release_contiguous_tensor(logits_view, logits);
+
+    return loss / (float) batch_size;
+}
+
+// parameter -= learning_rate * gradient
+void sgd_step(Tensor *parameter, const Tensor *gradient, float learning_rate) {
+    assert(parameter != NULL);
+    assert(gradient != NULL);
+    assert(is_tensor_contiguous(parameter));
+    assert(is_tensor_contiguous(gradient));
+
+    size_t num_elements = get_tensor_element_count(parameter);
+
+    assert(num_elements == get_tensor_element_count(gradient));
+
+    size_t i;
+    #pragma omp parallel for private(i)
+    for (i = 0; i < num_elements; i++) {
+        parameter->data[i] -= learning_rate * gradient->data[i];
+    }
+}
+
+AdamState *create_adam_state(const Tensor *parameter) {
+    assert(parameter != NULL);
+
+    AdamState *state = malloc(sizeof *state);
+    assert(state != NULL);
+
+    state->first_moment = create_zero_tensor(parameter->n_dims, parameter->dims);
+    state->second_moment = create_zero_tensor(parameter->n_dims, parameter->dims);
+    state->step = 0;
+
+    return state;
+}
+
+void destroy_adam_state(AdamState *state) {
+    assert(state != NULL);
+
+    destroy_tensor(state->first_moment);
+    destroy_tensor(state->second_moment);
+    free(state);
+}
+
+// One Adam update of parameter with bias-corrected moment estimates
+void adam_step(Tensor *parameter, const Tensor *gradient, AdamState *state, float learning_rate, float beta1, float beta2, float epsilon) {
+    assert(parameter != NULL);
+    assert(gradient != NULL);
+    assert(state != NULL);
+    assert(is_tensor_contiguous(parameter));
+    assert(is_tensor_contiguous(gradient));
+
+    size_t num_elements = get_tensor_element_count(parameter);
+
+    assert(num_elements == get_tensor_element_count(gradient));
+    assert(num_elements == get_tensor_element_count(state->first_moment));
+
+    state->step++;
+
+    float first_correction = 1.0f - powf(beta1, (float) state->step);
+    float second_correction = 1.0f - powf(beta2, (float) state->step);
+
+    float *first_moment = state->first_moment->data;
+    float *second_moment = state->second_moment->data;
+
+    size_t i;
+    #pragma omp parallel for private(i)
+    for (i = 0; i < num_elements; i++) {
+        float g = gradient->data[i];
+
+        first_moment[i] = beta1 * first_moment[i] + (1.0f - beta1) * g;
+        second_moment[i] = beta2 * second_moment[i] + (1.0f - beta2) * g * g;
+
+        float first_estimate = first_moment[i] / first_correction;
+        float second_estimate = second_moment[i] / second_correction;
+
+        parameter->data[i] -= learning_rate * first_estimate / (sqrtf(second_estimate) + epsilon);
+    }
+}
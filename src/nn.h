@@ -6,6 +6,14 @@
 
 #include "tensor.h"
 
+typedef struct AdamState AdamState;
+
+struct AdamState {
+    Tensor *first_moment;
+    Tensor *second_moment;
+    size_t step;
+};
+
 Tensor *remove_batch_size_if_present_from_3d_tensor(Tensor *t, bool has_batch_dim);
 
 Tensor *remove_batch_size_if_present_from_1d_tensor(Tensor *t, bool has_batch_dim);
@@ -14,6 +22,8 @@ Tensor *conv_2d(const Tensor *input, const Tensor *weight, const Tensor *bias, s
 
 Tensor *max_pool_2d(const Tensor *input, size_t pool_size, size_t stride);
 
+Tensor *max_pool_2d_with_argmax(const Tensor *input, size_t pool_size, size_t stride, size_t *argmax);
+
 Tensor *relu(const Tensor *input);
 
 Tensor *conv_relu_max_pool_2d(const Tensor *input, const Tensor *weight, const Tensor *bias, size_t conv_stride, size_t pool_size, size_t pool_stride);
@@ -24,4 +34,24 @@ Tensor *linear(const Tensor *input, const Tensor *weight, const Tensor *bias);
 
 Tensor *softmax(const Tensor *input);
 
+void linear_softmax_top_k(const Tensor *input, const Tensor *weight, const Tensor *bias, size_t k, size_t *top_indices, float *top_probabilities);
+
+void conv_2d_backward(const Tensor *input, const Tensor *weight, const Tensor *grad_output, size_t stride, Tensor **grad_input, Tensor **grad_weight, Tensor **grad_bias);
+
+Tensor *max_pool_2d_backward(const Tensor *input, const Tensor *grad_output, const size_t *argmax);
+
+Tensor *relu_backward(const Tensor *input, const Tensor *grad_output);
+
+void linear_backward(const Tensor *input, const Tensor *weight, const Tensor *grad_output, Tensor **grad_input, Tensor **grad_weight, Tensor **grad_bias);
+
+float softmax_cross_entropy(const Tensor *logits, const size_t *targets, Tensor **grad_logits);
+
+void sgd_step(Tensor *parameter, const Tensor *gradient, float learning_rate);
+
+AdamState *create_adam_state(const Tensor *parameter);
+
+void destroy_adam_state(AdamState *state);
+
+void adam_step(Tensor *parameter, const Tensor *gradient, AdamState *state, float learning_rate, float beta1, float beta2, float epsilon);
+
 #endif
@@ -24,6 +24,9 @@ Tensor *create_tensor(size_t n_dims, const size_t *dims) {
         t->dims[i] = dims[i];
     }
 
+    t->strides = NULL;
+    t->owns_data = true;
+
     return t;
 }
 
@@ -32,7 +35,12 @@ void destroy_tensor(Tensor *t) {
     assert(t != NULL);
 
     free(t->dims);
-    free(t->data);
+    free(t->strides);
+
+    if (t->owns_data) {
+        free(t->data);
+    }
+
     free(t);
 }
 
@@ -49,16 +57,31 @@ size_t get_tensor_element_count(const Tensor *t) {
     return num_elements;
 }
 
+// Maps the position of an element in numpy .flatten() order to its offset in t->data
+static size_t get_tensor_data_offset(const Tensor *t, size_t flat_index) {
+    if (t->strides == NULL) {
+        return flat_index;
+    }
+
+    size_t offset = 0;
+
+    for (size_t i = 0; i < t->n_dims; i++) {
+        size_t reverse_index = t->n_dims - 1 - i;
+
+        offset += (flat_index % t->dims[reverse_index]) * t->strides[reverse_index];
+        flat_index /= t->dims[reverse_index];
+    }
+
+    return offset;
+}
+
+// Always returns a contiguous tensor that owns its data, also for views
 Tensor *copy_tensor(const Tensor *t) {
     assert(t != NULL);
 
     Tensor *copy = create_tensor(t->n_dims, t->dims);
 
-    size_t num_elements = get_tensor_element_count(t);
-
-    for (size_t i = 0; i < num_elements; i++) {
-        copy->data[i] = t->data[i];
-    }
+    copy_tensor_into(copy, t);
 
     return copy;
 }
@@ -74,7 +97,7 @@ void load_tensor_from_file(const char *filename, Tensor *t) {
     size_t num_elements = get_tensor_element_count(t);
 
     for (size_t i = 0; i < num_elements; i++) {
-        fread(&t->data[i], sizeof(float), 1, file);  // Use fread for binary reading
+        fread(&t->data[get_tensor_data_offset(t, i)], sizeof(float), 1, file);  // Use fread for binary reading
     }
 
     fclose(file);
@@ -101,7 +124,7 @@ void write_tensor_to_file(const char *filename, const Tensor *t) {
     size_t num_elements = get_tensor_element_count(t);
 
     for (size_t i = 0; i < num_elements; i++) {
-        fwrite(&t->data[i], sizeof(float), 1, file);  // Use fwrite for binary writing
+        fwrite(&t->data[get_tensor_data_offset(t, i)], sizeof(float), 1, file);  // Use fwrite for binary writing
     }
 
     fclose(file);
@@ -126,7 +149,7 @@ void print_tensor(const Tensor *t) {
     printf("), data=[\n");
 
     for (size_t i = 0; i < num_elements; i++) {
-        float current_value = t->data[i];
+        float current_value = t->data[get_tensor_data_offset(t, i)];
 
         printf("  ");
 
@@ -163,7 +186,7 @@ size_t get_tensor_entry_index(const Tensor *t, const size_t *indices) {
     for (size_t i = 0; i < t->n_dims; i++) {
         size_t reverse_index = t->n_dims - 1 - i;
 
-        index += indices[reverse_index] * multiplier;
+        index += indices[reverse_index] * (t->strides != NULL ? t->strides[reverse_index] : multiplier);
         multiplier *= t->dims[reverse_index];
     }
 
@@ -192,9 +215,267 @@ Tensor *add_tensors(const Tensor *a, const Tensor *b) {
 
     size_t num_elements = get_tensor_element_count(a);
 
-    for (size_t i = 0; i < num_elements; i++) {
-        output->data[i] = a->data[i] + b->data[i];
+    if (is_tensor_contiguous(a) && is_tensor_contiguous(b)) {
+        for (size_t i = 0; i < num_elements; i++) {
+            output->data[i] = a->data[i] + b->data[i];
+        }
+    } else {
+        for (size_t i = 0; i < num_elements; i++) {
+            output->data[i] = a->data[get_tensor_data_offset(a, i)] + b->data[get_tensor_data_offset(b, i)];
+        }
     }
 
     return output;
 }
+
+size_t get_tensor_stride(const Tensor *t, size_t dim) {
+    assert(t != NULL);
+    assert(dim < t->n_dims);
+
+    if (t->strides != NULL) {
+        return t->strides[dim];
+    }
+
+    size_t stride = 1;
+
+    for (size_t i = dim + 1; i < t->n_dims; i++) {
+        stride *= t->dims[i];
+    }
+
+    return stride;
+}
+
+// True if the elements are laid out in row-major order without gaps, i.e.
+// t->data can be indexed directly with a flat index
+bool is_tensor_contiguous(const Tensor *t) {
+    assert(t != NULL);
+
+    if (t->strides == NULL) {
+        return true;
+    }
+
+    size_t expected_stride = 1;
+
+    for (size_t i = 0; i < t->n_dims; i++) {
+        size_t reverse_index = t->n_dims - 1 - i;
+
+        // The stride of a dimension of size 1 is never used
+        if (t->dims[reverse_index] != 1 && t->strides[reverse_index] != expected_stride) {
+            return false;
+        }
+
+        expected_stride *= t->dims[reverse_index];
+    }
+
+    return true;
+}
+
+// Offset of the last element of t relative to t->data
+static size_t get_tensor_last_offset(const Tensor *t) {
+    size_t offset = 0;
+
+    for (size_t i = 0; i < t->n_dims; i++) {
+        offset += (t->dims[i] - 1) * get_tensor_stride(t, i);
+    }
+
+    return offset;
+}
+
+// Creates a view on the data of t; offset and strides are in elements and
+// relative to t->data. Passing NULL as strides gives a contiguous view.
+//
+// The view shares the buffer of whichever tensor owns it (t itself, or for a
+// view of a view the tensor the first view was taken from), must be destroyed
+// before that owner, and never frees the buffer itself. Although t is const,
+// the view is writable: copy_tensor_into and concat_tensors_into write
+// through views into the buffer of t.
+Tensor *create_tensor_view(const Tensor *t, size_t n_dims, const size_t *dims, const size_t *strides, size_t offset) {
+    assert(t != NULL);
+    assert(dims != NULL);
+
+    Tensor *view = malloc(sizeof *view);
+    assert(view != NULL);
+
+    view->n_dims = n_dims;
+    view->dims = malloc(n_dims * sizeof *view->dims);
+    assert(view->dims != NULL);
+
+    for (size_t i = 0; i < n_dims; i++) {
+        view->dims[i] = dims[i];
+    }
+
+    if (strides != NULL) {
+        view->strides = malloc(n_dims * sizeof *view->strides);
+        assert(view->strides != NULL);
+
+        for (size_t i = 0; i < n_dims; i++) {
+            view->strides[i] = strides[i];
+        }
+    } else {
+        view->strides = NULL;
+    }
+
+    view->data = t->data + offset;
+    view->owns_data = false;
+
+    // The view may only reach elements within the span of t
+    if (get_tensor_element_count(view) > 0) {
+        assert(get_tensor_element_count(t) > 0);
+        assert(offset + get_tensor_last_offset(view) <= get_tensor_last_offset(t));
+    }
+
+    return view;
+}
+
+// Zero-copy view on the entries [start, end) along dimension dim
+Tensor *slice_tensor(const Tensor *t, size_t dim, size_t start, size_t end) {
+    assert(t != NULL);
+    assert(dim < t->n_dims);
+    assert(start <= end && end <= t->dims[dim]);
+
+    size_t *dims = malloc(t->n_dims * sizeof *dims);
+    size_t *strides = malloc(t->n_dims * sizeof *strides);
+    assert(dims != NULL);
+    assert(strides != NULL);
+
+    for (size_t i = 0; i < t->n_dims; i++) {
+        dims[i] = t->dims[i];
+        strides[i] = get_tensor_stride(t, i);
+    }
+
+    dims[dim] = end - start;
+
+    Tensor *view = create_tensor_view(t, t->n_dims, dims, strides, start * strides[dim]);
+
+    // Slicing along the outermost dimensions keeps the view contiguous
+    if (is_tensor_contiguous(view)) {
+        free(view->strides);
+        view->strides = NULL;
+    }
+
+    free(dims);
+    free(strides);
+
+    return view;
+}
+
+// Zero-copy reshape; only possible for contiguous tensors
+Tensor *reshape_tensor(const Tensor *t, size_t n_dims, const size_t *dims) {
+    assert(t != NULL);
+    assert(dims != NULL);
+    assert(is_tensor_contiguous(t));
+
+    size_t num_elements = 1;
+
+    for (size_t i = 0; i < n_dims; i++) {
+        num_elements *= dims[i];
+    }
+
+    assert(num_elements == get_tensor_element_count(t));
+
+    return create_tensor_view(t, n_dims, dims, NULL, 0);
+}
+
+// Splits t along its first (batch) dimension into n_splits views, where view i
+// holds split_sizes[i] consecutive entries. The sizes must add up to t->dims[0].
+void split_tensor_batch(const Tensor *t, size_t n_splits, const size_t *split_sizes, Tensor **views) {
+    assert(t != NULL);
+    assert(t->n_dims > 0);
+    assert(split_sizes != NULL);
+    assert(views != NULL);
+
+    size_t start = 0;
+
+    for (size_t i = 0; i < n_splits; i++) {
+        views[i] = slice_tensor(t, 0, start, start + split_sizes[i]);
+        start += split_sizes[i];
+    }
+
+    assert(start == t->dims[0]);
+}
+
+// Copies the entries of source into destination, which must have the same
+// shape; either side can be a view
+void copy_tensor_into(Tensor *destination, const Tensor *source) {
+    assert(destination != NULL);
+    assert(source != NULL);
+
+    assert(destination->n_dims == source->n_dims);
+
+    for (size_t i = 0; i < source->n_dims; i++) {
+        assert(destination->dims[i] == source->dims[i]);
+    }
+
+    size_t num_elements = get_tensor_element_count(source);
+
+    if (is_tensor_contiguous(destination) && is_tensor_contiguous(source)) {
+        for (size_t i = 0; i < num_elements; i++) {
+            destination->data[i] = source->data[i];
+        }
+
+        return;
+    }
+
+    if (num_elements == 0) {
+        return;
+    }
+
+    // Walk the outer dimensions with an odometer and copy the innermost
+    // dimension as one strided run (0-d tensors are always contiguous)
+    size_t n_dims = source->n_dims;
+    size_t inner_size = source->dims[n_dims - 1];
+    size_t source_inner_stride = get_tensor_stride(source, n_dims - 1);
+    size_t destination_inner_stride = get_tensor_stride(destination, n_dims - 1);
+
+    size_t *indices = calloc(n_dims, sizeof *indices);
+    assert(indices != NULL);
+
+    for (size_t run = 0; run < num_elements / inner_size; run++) {
+        size_t source_offset = 0;
+        size_t destination_offset = 0;
+
+        for (size_t i = 0; i + 1 < n_dims; i++) {
+            source_offset += indices[i] * get_tensor_stride(source, i);
+            destination_offset += indices[i] * get_tensor_stride(destination, i);
+        }
+
+        for (size_t k = 0; k < inner_size; k++) {
+            destination->data[destination_offset + k * destination_inner_stride] = source->data[source_offset + k * source_inner_stride];
+        }
+
+        for (size_t i = n_dims - 1; i-- > 0;) {
+            if (++indices[i] < source->dims[i]) {
+                break;
+            }
+
+            indices[i] = 0;
+        }
+    }
+
+    free(indices);
+}
+
+// Concatenates inputs along dimension dim into the preallocated output, whose
+// size along dim must equal the sum of the input sizes
+void concat_tensors_into(Tensor *output, size_t dim, size_t n_inputs, const Tensor *const *inputs) {
+    assert(output != NULL);
+    assert(inputs != NULL);
+    assert(dim < output->n_dims);
+
+    size_t start = 0;
+
+    for (size_t i = 0; i < n_inputs; i++) {
+        assert(inputs[i] != NULL);
+        assert(inputs[i]->n_dims == output->n_dims);
+
+        size_t end = start + inputs[i]->dims[dim];
+        Tensor *destination = slice_tensor(output, dim, start, end);
+
+        copy_tensor_into(destination, inputs[i]);
+
+        destroy_tensor(destination);
+        start = end;
+    }
+
+    assert(start == output->dims[dim]);
+}
@@ -12,7 +12,13 @@ typedef struct Tensor Tensor;
 struct Tensor {
     size_t n_dims;
     size_t *dims;
+    // Points at the first element of the tensor; for views this already
+    // includes the offset into the buffer of the tensor they were taken from
     float *data;
+    // Element strides per dimension, or NULL for a contiguous row-major layout
+    size_t *strides;
+    // False for views, which share their data with another tensor
+    bool owns_data;
 };
 
 Tensor *create_tensor(size_t n_dims, const size_t *dims);
@@ -37,4 +43,20 @@ float get_tensor_entry_value(const Tensor *t, const size_t *indices);
 
 Tensor *add_tensors(const Tensor *a, const Tensor *b);
 
+size_t get_tensor_stride(const Tensor *t, size_t dim);
+
+bool is_tensor_contiguous(const Tensor *t);
+
+Tensor *create_tensor_view(const Tensor *t, size_t n_dims, const size_t *dims, const size_t *strides, size_t offset);
+
+Tensor *slice_tensor(const Tensor *t, size_t dim, size_t start, size_t end);
+
+Tensor *reshape_tensor(const Tensor *t, size_t n_dims, const size_t *dims);
+
+void split_tensor_batch(const Tensor *t, size_t n_splits, const size_t *split_sizes, Tensor **views);
+
+void copy_tensor_into(Tensor *destination, const Tensor *source);
+
+void concat_tensors_into(Tensor *output, size_t dim, size_t n_inputs, const Tensor *const *inputs);
+
 #endif